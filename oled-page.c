@@ -5,6 +5,7 @@
 #include <linux/delay.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 #include <linux/ioctl.h>
@@ -13,21 +14,33 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/pm_runtime.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
 #include "font_8x8.h"           // lookup table to display 8x8 characters
+#include "oled_ring.h"          // shared memory command ring
 
 /* procfs macros */
 #define procfs_name "oled_driver"
-#define PROCFS_MAX_SIZE 150
 
 /* i2c macros */
 #define I2C_BUS_AVAILABLE   (          1 )              // I2C Bus available in our Raspberry Pi
 #define SLAVE_DEVICE_NAME   ( "OLED" )              // Device and Driver Name
 #define SSD1315_SLAVE_ADDR  (       0x3C )              // SSD1315 OLED Slave Address
+#define SSD1315_POWER_ON_MS (        100 )              // Datasheet worst case from VDD stable to accepting commands
 							
 /* oled RAM structure macros */
 #define PAGE_0 0xB0					// Address of Page 0 in GDDRAM
 #define MAX_PAGE 0xB7					// Max no. of pages in GDDRAM
 #define TOTAL_SEG 128					// Total segments in GDDRAM
+#define TOTAL_PAGES 8					// Total pages in GDDRAM
+#define FRAME_SIZE (TOTAL_PAGES * TOTAL_SEG)		// 1 KiB, page-major, LSB = top row of the page
 
 /* ioctl commands */
 #define DISPLAY_STRING _IOW('a', 'a', char*)
@@ -35,11 +48,54 @@
 #define BLINKING _IOW('a', 'c', int*)
 #define SCROLLING _IOW('a', 'd', int*)
 #define CLEAR_SCREEN _IOW('a', 'e', int*)
+#define SET_SCHED _IOW('a', 'g', struct oled_sched_param*)
+
+/* update classes, a lower value wins the panel first */
+enum {
+	OLED_CLASS_ALERT,
+	OLED_CLASS_INTERACTIVE,		// default for ioctl and sysfs
+	OLED_CLASS_STREAM,		// command ring
+	OLED_CLASS_BULK,		// default for write(), calibration
+	OLED_NR_CLASSES
+};
+
+/*
+** SET_SCHED argument: class used by later ioctl/write calls on the file and
+** an optional deadline. An update that has waited deadline_us for the panel
+** is promoted above every class (0 = class_deadline_us of its class).
+*/
+struct oled_sched_param {
+	int update_class;
+	unsigned int deadline_us;
+};
 
 #define ON 1
 #define NEWLINE 10
 #define STRING_LIMIT 100
 
+/* power management */
+static int idle_timeout_ms = 30000;
+module_param(idle_timeout_ms, int, 0444);
+MODULE_PARM_DESC(idle_timeout_ms, "Idle time before the panel is put to sleep, -1 = never (runtime: power/autosuspend_delay_ms)");
+
+static bool idle_pump_off = false;
+module_param(idle_pump_off, bool, 0644);
+MODULE_PARM_DESC(idle_pump_off, "Also switch the charge pump off while the panel sleeps");
+
+/* i2c transfer shape */
+#define XFER_MIN_CHUNK 16				// smallest data burst tried by the calibration
+#define XFER_MAX_MSGS 16				// most messages combined in one i2c_transfer()
+#define CALIBRATE_ROUNDS 4				// frames sent per measured transfer shape
+
+/* an update waiting longer than this for the panel is promoted to alert, 0 = never */
+static unsigned int class_deadline_us [OLED_NR_CLASSES] = { 0, 100000, 500000, 2000000 };
+module_param_array(class_deadline_us, uint, NULL, 0644);
+MODULE_PARM_DESC(class_deadline_us, "Default promotion deadline in us per class: alert,interactive,stream,bulk (SET_SCHED overrides it per file)");
+
+static bool calibrate_on_probe = false;
+module_param(calibrate_on_probe, bool, 0444);
+MODULE_PARM_DESC(calibrate_on_probe, "Measure the fastest I2C transfer shape after the first frame");
+
 static struct i2c_adapter *i2c_adapter     = NULL;  // I2C Adapter Structure
 static struct i2c_client  *i2c_client_oled = NULL;  // I2C Client Structure (In our case it is OLED)
 
@@ -49,13 +105,86 @@ static struct cdev oled_cdev;
 struct kobject *kobj_ref;
 static struct proc_dir_entry *pd_entry;
 
+/*
+** Panel arbitration: one holder at a time (taken with oled_lock), waiters
+** are admitted highest class first. Long flushes yield at a page boundary
+** when a higher class is waiting.
+*/
+static DEFINE_SPINLOCK(sched_lock);
+static DECLARE_WAIT_QUEUE_HEAD(sched_wq);
+static bool sched_busy = false;
+static int sched_owner = -1;			// effective class of the holder
+static struct task_struct *sched_holder;
+static unsigned int sched_waiting [OLED_NR_CLASSES];
+
+static struct oled_class_stats {
+	unsigned long updates;
+	unsigned long promoted;			// deadline passed while waiting
+	unsigned long preempted;		// yielded to a higher class mid flush
+	u64 wait_total_us;
+	u64 wait_max_us;
+} sched_stats [OLED_NR_CLASSES];
+/* sched_stats is written under sched_lock, readers only retry on this */
+static seqcount_spinlock_t sched_stats_seq = SEQCNT_SPINLOCK_ZERO(sched_stats_seq, &sched_lock);
+
+static const char * const class_names [OLED_NR_CLASSES] = {
+	"alert", "interactive", "stream", "bulk"
+};
+static bool ram_lost = false;		// GDDRAM has to be restored from frame_buffer on wake
+enum {
+	OLED_PROBING,		// panel_init_work has not finished, updates get -EAGAIN
+	OLED_READY,		// first frame sent and runtime PM enabled
+	OLED_FAILED		// the display did not answer or was removed, updates get -ENODEV
+};
+static int oled_state = OLED_PROBING;
+static const char * const state_names [] = { "probing", "ready", "failed" };
+static bool frame_valid = false;	// frame_buffer holds content worth showing again
+static ktime_t load_time;		// module load, reference for the time to first frame
+static s64 first_frame_us = -1;
+
+/*
+** Data bytes per I2C message and messages per i2c_transfer() used for
+** GDDRAM writes. Tuned per adapter by oled_calibrate(), see sysfs.
+*/
+static unsigned int xfer_chunk = FRAME_SIZE;
+static unsigned int xfer_msgs = 1;
+
+/* shared memory command ring, drained by ring_work */
+static void *ring;
+static struct oled_ring_hdr *ring_hdr;
+static struct oled_ring_cmd *ring_cmds;
+static struct file *ring_producer;	// the one open file allowed to map the ring
+static u32 ring_tail;			// consumer index, ring_hdr->tail is only a published copy
+static void ring_work_fn(struct work_struct *work);
+static DECLARE_WORK(ring_work, ring_work_fn);
+static void panel_init_work_fn(struct work_struct *work);
+static DECLARE_WORK(panel_init_work, panel_init_work_fn);
+
+/* pages drawn by ring records since the last commit, empty when first > last */
+static unsigned int dirty_first = TOTAL_PAGES;
+static unsigned int dirty_last = 0;
+static unsigned long frame_seq = 0;		// flushes sent to the panel
+
 static long oled_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static ssize_t oled_write(struct file *file, const char __user *buf, size_t count, loff_t *offp);
+static loff_t oled_llseek(struct file *file, loff_t offset, int whence);
+static int oled_mmap(struct file *file, struct vm_area_struct *vma);
+static int oled_open(struct inode *inode, struct file *file);
+static int oled_release(struct inode *inode, struct file *file);
 
-static void draw (char *display_string);
+static int draw (char *display_string);
 static void zoom_in (bool zoom_in);
 static void fade_blink (bool blink);
 static void scroll (bool blink);
-static void clear_display (void);
+static int clear_display (void);
+static int flush_pages (unsigned int first_page, unsigned int last_page);
+static int flush_frame (void);
+static int oled_calibrate (void);
+static int oled_lock (int update_class, unsigned int deadline_us);
+static void oled_unlock (void);
+static int oled_yield (void);
+static int oled_begin_update (int update_class, unsigned int deadline_us);
+static void oled_end_update (void);
 
 /* Sysfs Functions */
 static ssize_t string_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
@@ -70,17 +199,36 @@ static ssize_t blink_store(struct kobject *kobj, struct kobj_attribute *attr,con
 static ssize_t scroll_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
 static ssize_t scroll_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count);
 
+static ssize_t xfer_chunk_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t xfer_chunk_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count);
+
+static ssize_t xfer_msgs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t xfer_msgs_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count);
+
+static ssize_t calibrate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t calibrate_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count);
+
+static ssize_t sched_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
 /* attributes under the k_obj */
 struct kobj_attribute display_attr = __ATTR(string_to_display, 0660, string_show, string_store);
 struct kobj_attribute zoom_attr = __ATTR(zoom, 0660, zoom_show, zoom_store);
 struct kobj_attribute blink_attr = __ATTR(blink, 0660, blink_show, blink_store);
 struct kobj_attribute scroll_attr = __ATTR(scroll, 0660, scroll_show, scroll_store);
+struct kobj_attribute xfer_chunk_attr = __ATTR(xfer_chunk, 0660, xfer_chunk_show, xfer_chunk_store);
+struct kobj_attribute xfer_msgs_attr = __ATTR(xfer_msgs, 0660, xfer_msgs_show, xfer_msgs_store);
+struct kobj_attribute calibrate_attr = __ATTR(calibrate, 0660, calibrate_show, calibrate_store);
+struct kobj_attribute sched_stats_attr = __ATTR(sched_stats, 0444, sched_stats_show, NULL);
 
 static struct attribute *oled_attrs [] = {
         &display_attr.attr,
         &zoom_attr.attr,
         &blink_attr.attr,
         &scroll_attr.attr,
+        &xfer_chunk_attr.attr,
+        &xfer_msgs_attr.attr,
+        &calibrate_attr.attr,
+        &sched_stats_attr.attr,
         NULL
 };
 
@@ -93,18 +241,341 @@ static struct file_operations fops =
 {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = oled_ioctl,
+	.write = oled_write,
+	.llseek = oled_llseek,
+	.mmap = oled_mmap,
+	.open = oled_open,
+	.release = oled_release,
 };
 
+/*
+** Shadow copy of the GDDRAM in SSD1315 page-major layout:
+** frame_buffer [page * TOTAL_SEG + column], bit 0 = top row of the page.
+*/
+static unsigned char frame_buffer [FRAME_SIZE];
+
+/* takes the panel if it is free and nobody of a higher class is waiting */
+static bool sched_try_take (int update_class)
+{
+	bool taken = false;
+
+	spin_lock(&sched_lock);
+	if (!sched_busy) {
+		taken = true;
+		for (int c = 0; c < update_class; c++)
+			if (sched_waiting [c])
+				taken = false;
+	}
+	if (taken) {
+		sched_waiting [update_class]--;
+		sched_busy = true;
+		sched_owner = update_class;
+		sched_holder = current;
+	}
+	spin_unlock(&sched_lock);
+	return taken;
+}
+
+/*
+** Waits for the panel as update_class. The waiter is promoted to
+** so it is next after at most one page of a non-alert holder's flush and
+** so it is next after at most one page of the current holder's flush and
+** no class starves.
+** Returns the class the panel was taken with, -EINTR if the task was killed.
+*/
+static int sched_acquire (int update_class, unsigned int deadline_us)
+{
+	int eff = update_class;
+	long ret;
+
+	if (deadline_us == 0)
+		deadline_us = READ_ONCE(class_deadline_us [update_class]);
+
+	spin_lock(&sched_lock);
+	sched_waiting [eff]++;
+	spin_unlock(&sched_lock);
+
+	if (deadline_us && eff != OLED_CLASS_ALERT) {
+		ret = wait_event_killable_timeout(sched_wq, sched_try_take (eff),
+						  max(usecs_to_jiffies(deadline_us), 1UL));
+		if (ret > 0)
+			return eff;
+		if (ret < 0)
+			goto killed;
+
+		spin_lock(&sched_lock);
+		sched_waiting [eff]--;
+		eff = OLED_CLASS_ALERT;
+		sched_waiting [eff]++;
+		write_seqcount_begin(&sched_stats_seq);
+		sched_stats [update_class].promoted++;
+		write_seqcount_end(&sched_stats_seq);
+		spin_unlock(&sched_lock);
+	}
+	if (wait_event_killable(sched_wq, sched_try_take (eff)) == 0)
+		return eff;
+
+killed:
+	spin_lock(&sched_lock);
+	sched_waiting [eff]--;
+	spin_unlock(&sched_lock);
+	wake_up_all(&sched_wq);		// lower classes may have waited behind us
+	return -EINTR;
+}
+
+static int oled_lock (int update_class, unsigned int deadline_us)
+{
+	ktime_t start = ktime_get();
+	u64 waited;
+
+	if (sched_acquire (update_class, deadline_us) < 0)
+		return -EINTR;
+	waited = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&sched_lock);
+	write_seqcount_begin(&sched_stats_seq);
+	sched_stats [update_class].updates++;
+	sched_stats [update_class].wait_total_us += waited;
+	sched_stats [update_class].wait_max_us = max(sched_stats [update_class].wait_max_us, waited);
+	write_seqcount_end(&sched_stats_seq);
+	spin_unlock(&sched_lock);
+	return 0;
+}
+
+/* no-op if the panel was already lost in oled_yield() */
+static void oled_unlock (void)
+{
+	spin_lock(&sched_lock);
+	if (sched_holder != current) {
+		spin_unlock(&sched_lock);
+		return;
+	}
+	sched_busy = false;
+	sched_owner = -1;
+	sched_holder = NULL;
+	spin_unlock(&sched_lock);
+	wake_up_all(&sched_wq);
+}
+
+/* true when the caller holds the panel below OLED_CLASS_ALERT */
+static bool oled_preemptible (void)
+{
+	return READ_ONCE(sched_holder) == current && READ_ONCE(sched_owner) != OLED_CLASS_ALERT;
+}
+
+/* true when an update of a higher class than the holder waits for the panel */
+static bool oled_higher_waiting (void)
+{
+	int owner = READ_ONCE(sched_owner);
+
+	for (int c = 0; c < owner; c++)
+		if (READ_ONCE(sched_waiting [c]))
+			return true;
+	return false;
+}
+
+/*
+** Called between the transfers of a long flush. If a higher class is
+** waiting the panel is handed over and taken back afterwards; returns 1 in
+** that case, the caller has to re-send any addressing state. Returns 0 if
+** the caller kept the panel and -EINTR if it was killed while waiting to get
+** it back; the panel is not held then and the caller has to stop sending.
+*/
+static int oled_yield (void)
+{
+	int owner = READ_ONCE(sched_owner);
+
+	if (!oled_preemptible () || !oled_higher_waiting ())
+		return 0;
+
+	spin_lock(&sched_lock);
+	write_seqcount_begin(&sched_stats_seq);
+	sched_stats [owner].preempted++;
+	write_seqcount_end(&sched_stats_seq);
+	spin_unlock(&sched_lock);
+
+	oled_unlock ();
+	if (sched_acquire (owner, 0) < 0)
+		return -EINTR;
+	return 1;
+}
+
+/*
+** Every path that talks to the panel is bracketed by these two. The first
+** update after an idle period resumes the device (see oled_runtime_resume),
+** the last one re-arms the autosuspend timer.
+*/
+static int oled_begin_update (int update_class, unsigned int deadline_us)
+{
+	int ret;
+
+	if (i2c_client_oled == NULL)
+		return -ENODEV;
+	switch (READ_ONCE(oled_state)) {
+	case OLED_PROBING:
+		return -EAGAIN;		// panel_init_work has not finished yet
+	case OLED_FAILED:
+		return -ENODEV;
+	}
+
+	ret = pm_runtime_resume_and_get(&i2c_client_oled->dev);
+	if (ret < 0) {
+		printk (KERN_ERR "oled: cannot wake the display (%d)\n", ret);
+		/* clears the runtime PM error, the next update tries again */
+		pm_runtime_set_suspended(&i2c_client_oled->dev);
+		return ret;
+	}
+	ret = oled_lock (update_class, deadline_us);
+	if (ret)
+		pm_runtime_put_autosuspend(&i2c_client_oled->dev);
+	return ret;
+}
+
+static void oled_end_update (void)
+{
+	oled_unlock ();
+	pm_runtime_mark_last_busy(&i2c_client_oled->dev);
+	pm_runtime_put_autosuspend(&i2c_client_oled->dev);
+}
+
+/* per open file scheduling, set with SET_SCHED */
+struct oled_file {
+	int update_class;		// -1 = default of the call
+	unsigned int deadline_us;
+};
+
+static int oled_open(struct inode *inode, struct file *file)
+{
+	struct oled_file *of = kzalloc(sizeof(*of), GFP_KERNEL);
+
+	if (of == NULL)
+		return -ENOMEM;
+	of->update_class = -1;
+	file->private_data = of;
+	return 0;
+}
+
+static int oled_release(struct inode *inode, struct file *file)
+{
+	/* the mappings hold a file reference, so they are all gone by now */
+	cmpxchg(&ring_producer, file, NULL);
+	kfree(file->private_data);
+	return 0;
+}
+
+static int file_begin_update (struct file *file, int default_class)
+{
+	struct oled_file *of = file->private_data;
+
+	if (of->update_class < 0)
+		return oled_begin_update (default_class, of->deadline_us);
+	return oled_begin_update (of->update_class, of->deadline_us);
+}
+
+/*
+** write() on /dev/oled_device takes raw frame data at the file offset
+** (pwrite(fd, frame, FRAME_SIZE, 0) uploads a whole frame). Only the
+** pages touched by the write are sent to the panel.
+*/
+static ssize_t oled_write(struct file *file, const char __user *buf, size_t count, loff_t *offp)
+{
+	loff_t pos = *offp;
+	int ret;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= FRAME_SIZE)
+		return -ENOSPC;
+	if (count > FRAME_SIZE - pos)
+		count = FRAME_SIZE - pos;
+	if (count == 0)
+		return 0;
+
+	ret = file_begin_update (file, OLED_CLASS_BULK);
+	if (ret)
+		return ret;
+
+	if (copy_from_user(frame_buffer + pos, buf, count)) {
+		printk (KERN_INFO "Copy_from_user_failed\n");
+		oled_end_update ();
+		return -EFAULT;
+	}
+
+	frame_valid = true;
+	ret = flush_pages (pos / TOTAL_SEG, (pos + count - 1) / TOTAL_SEG);
+	oled_end_update ();
+	if (ret)
+		return ret;
+	*offp = pos + count;
+	return count;
+}
+
+static loff_t oled_llseek(struct file *file, loff_t offset, int whence)
+{
+	return fixed_size_llseek(file, offset, whence, FRAME_SIZE);
+}
+
+/*
+** mmap() on /dev/oled_device maps the command ring (see oled_ring.h).
+** The ring has a single producer: the first open file that maps it owns it
+** until that file is released, other files get -EBUSY.
+*/
+static int oled_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct file *owner;
+	int ret;
+
+	if (vma->vm_pgoff != 0)
+		return -EINVAL;
+	owner = cmpxchg(&ring_producer, NULL, file);
+	if (owner != NULL && owner != file)
+		return -EBUSY;
+	if (owner == NULL) {
+		/* the previous producer may have scribbled over tail */
+		smp_store_release(&ring_hdr->tail, READ_ONCE(ring_tail));
+	}
+	ret = remap_vmalloc_range(vma, ring, 0);
+	if (ret && owner == NULL)
+		cmpxchg(&ring_producer, file, NULL);	// nothing mapped, give the ring back
+	return ret;
+}
+
 
 static long oled_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+	int ret;
+
+	/* ring producers only kick the flush worker, no panel access here */
+	if (cmd == OLED_RING_DOORBELL) {
+		schedule_work(&ring_work);
+		return 0;
+	}
+	if (cmd == SET_SCHED) {
+		struct oled_file *of = file->private_data;
+		struct oled_sched_param param;
+
+		if (copy_from_user(&param, (struct oled_sched_param*) arg, sizeof(param)))
+			return -EFAULT;
+		if (param.update_class < 0 || param.update_class >= OLED_NR_CLASSES)
+			return -EINVAL;
+		of->update_class = param.update_class;
+		of->deadline_us = param.deadline_us;
+		return 0;
+	}
+
+	ret = file_begin_update (file, OLED_CLASS_INTERACTIVE);
+	if (ret)
+		return ret;
+
 	switch (cmd) {
 		case DISPLAY_STRING:
 			char user_string[STRING_LIMIT] = {'\0'};
 			if (strncpy_from_user(user_string, (char*) arg, STRING_LIMIT)) {
-				clear_display ();
+				ret = clear_display ();
+				if (ret)
+					break;
                                 printk (KERN_INFO "%s\n", user_string);
-				draw (user_string);
+				ret = draw (user_string);
 			}
 			else
 				printk (KERN_INFO "Copy_from_user_failed\n");
@@ -146,7 +617,8 @@ static long oled_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				printk (KERN_INFO "Copy_from_user_failed\n");
 			break;
 	}
-	return 0;
+	oled_end_update ();
+	return ret;
 }
 
 char string_to_display [STRING_LIMIT] = {'\0'};
@@ -162,11 +634,18 @@ static ssize_t string_show(struct kobject *kobj, struct kobj_attribute *attr, ch
 
 static ssize_t string_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
 {
+        int ret;
+
         printk(KERN_INFO "oled:sysfs:string: Write!!!\n");
-        sscanf(buf,"%s",string_to_display);
-        clear_display ();
-        draw (string_to_display);
-        return count;
+        ret = oled_begin_update (OLED_CLASS_INTERACTIVE, 0);
+        if (ret)
+                return ret;
+        sscanf(buf,"%99s",string_to_display);
+        ret = clear_display ();
+        if (ret == 0)
+                ret = draw (string_to_display);
+        oled_end_update ();
+        return ret ? ret : count;
 }
 
 static ssize_t zoom_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
@@ -177,7 +656,12 @@ static ssize_t zoom_show(struct kobject *kobj, struct kobj_attribute *attr, char
 
 static ssize_t zoom_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
 {
+        int ret;
+
         printk(KERN_INFO "oled:sysfs:zoom: Write!!!\n");
+        ret = oled_begin_update (OLED_CLASS_INTERACTIVE, 0);
+        if (ret)
+                return ret;
         sscanf(buf,"%d",&zoom_on);
         printk ("%d\n", zoom_on);
         if (zoom_on == ON)
@@ -186,6 +670,7 @@ static ssize_t zoom_store(struct kobject *kobj, struct kobj_attribute *attr,cons
                 zoom_in (false);
         else
                 printk ("oled:sysfs:zoom:write: INVALID ARGUMENT (only 1/0 is valid)\n");
+        oled_end_update ();
         return count;
 }
 
@@ -197,7 +682,12 @@ static ssize_t blink_show(struct kobject *kobj, struct kobj_attribute *attr, cha
 
 static ssize_t blink_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
 {
+        int ret;
+
         printk(KERN_INFO "oled:sysfs:blink: Write!!!\n");
+        ret = oled_begin_update (OLED_CLASS_INTERACTIVE, 0);
+        if (ret)
+                return ret;
         sscanf(buf,"%d",&blink_on);
         if (blink_on == ON)
                 fade_blink (true);
@@ -205,6 +695,7 @@ static ssize_t blink_store(struct kobject *kobj, struct kobj_attribute *attr,con
                 fade_blink (false);
         else
                 printk ("oled:sysfs:blink:write: INVALID ARGUMENT (only 1/0 is valid)\n");
+        oled_end_update ();
         return count;
 }
 
@@ -216,7 +707,12 @@ static ssize_t scroll_show(struct kobject *kobj, struct kobj_attribute *attr, ch
 
 static ssize_t scroll_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
 {
+        int ret;
+
         printk(KERN_INFO "oled:sysfs:scroll: Write!!!\n");
+        ret = oled_begin_update (OLED_CLASS_INTERACTIVE, 0);
+        if (ret)
+                return ret;
         sscanf(buf,"%d", &scroll_on);
         if (scroll_on == ON)
                 scroll (true);
@@ -224,34 +720,194 @@ static ssize_t scroll_store(struct kobject *kobj, struct kobj_attribute *attr,co
                 scroll (false);
         else
                 printk ("oled:sysfs:scroll:write: INVALID ARGUMENT (only 1/0 is valid)\n");
+        oled_end_update ();
         return count;
 }
 
-static ssize_t procfile_read(struct file* filp, char *buf, size_t count, loff_t *offp)
+static ssize_t xfer_chunk_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	int ret = 0;
-	char tmp[PROCFS_MAX_SIZE] = {'\0'};
-	printk(KERN_INFO "procfile_read (/proc/%s) called\n", procfs_name);
+        printk(KERN_INFO "oled:sysfs:xfer_chunk: Read!!!\n");
+        return sprintf(buf, "%u\n", READ_ONCE(xfer_chunk));
+}
 
-	if(*offp > 0)
-	{
-		return 0;
-	}
+static ssize_t xfer_chunk_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
+{
+        unsigned int chunk;
 
-	sprintf(tmp, "user string on display:%s\nzoom : %d\nblink: %d\nscroll: %d\n", string_to_display, zoom_on, blink_on, scroll_on);
-	if(copy_to_user(buf, tmp, strlen(tmp)))
-	{
-		printk(KERN_ERR "Error in copy to user\n");
-		return -EFAULT;
-	}
+        printk(KERN_INFO "oled:sysfs:xfer_chunk: Write!!!\n");
+        if (kstrtouint(buf, 0, &chunk) || chunk < XFER_MIN_CHUNK || chunk > FRAME_SIZE) {
+                printk ("oled:sysfs:xfer_chunk:write: INVALID ARGUMENT (%d - %d)\n", XFER_MIN_CHUNK, FRAME_SIZE);
+                return -EINVAL;
+        }
+        if (oled_lock (OLED_CLASS_INTERACTIVE, 0))
+                return -EINTR;
+        xfer_chunk = chunk;
+        oled_unlock ();
+        return count;
+}
 
-	ret = *offp = strlen(tmp);
-	return ret;
+static ssize_t xfer_msgs_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+        printk(KERN_INFO "oled:sysfs:xfer_msgs: Read!!!\n");
+        return sprintf(buf, "%u\n", READ_ONCE(xfer_msgs));
 }
 
-const static struct proc_ops proc_fops = /* for /proc operations */
+static ssize_t xfer_msgs_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
 {
-	proc_read : procfile_read
+        unsigned int msgs;
+
+        printk(KERN_INFO "oled:sysfs:xfer_msgs: Write!!!\n");
+        if (kstrtouint(buf, 0, &msgs) || msgs < 1 || msgs > XFER_MAX_MSGS) {
+                printk ("oled:sysfs:xfer_msgs:write: INVALID ARGUMENT (1 - %d)\n", XFER_MAX_MSGS);
+                return -EINVAL;
+        }
+        if (oled_lock (OLED_CLASS_INTERACTIVE, 0))
+                return -EINTR;
+        xfer_msgs = msgs;
+        oled_unlock ();
+        return count;
+}
+
+/*
+** Result of the last calibration, one line per transfer shape tried:
+** "<chunk> <msgs> <bytes/s>", 0 bytes/s = shape rejected by the adapter.
+*/
+#define CALIBRATE_MAX_SHAPES 24
+static struct {
+	unsigned int chunk;
+	unsigned int msgs;
+	unsigned int rate;
+} calibrate_result [CALIBRATE_MAX_SHAPES];
+static unsigned int calibrate_shapes = 0;
+
+static ssize_t calibrate_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+        ssize_t len = 0;
+
+        printk(KERN_INFO "oled:sysfs:calibrate: Read!!!\n");
+        if (oled_lock (OLED_CLASS_INTERACTIVE, 0))
+                return -EINTR;
+        for (unsigned int i = 0; i < calibrate_shapes; i++)
+                len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u %u%s\n",
+                                 calibrate_result [i].chunk, calibrate_result [i].msgs, calibrate_result [i].rate,
+                                 (calibrate_result [i].chunk == xfer_chunk &&
+                                  calibrate_result [i].msgs == xfer_msgs) ? " *" : "");
+        oled_unlock ();
+        return len;
+}
+
+static ssize_t calibrate_store(struct kobject *kobj, struct kobj_attribute *attr,const char *buf, size_t count)
+{
+        int ret;
+
+        printk(KERN_INFO "oled:sysfs:calibrate: Write!!!\n");
+        ret = oled_begin_update (OLED_CLASS_BULK, 0);
+        if (ret)
+                return ret;
+        ret = oled_calibrate ();
+        oled_end_update ();
+        return ret ? ret : count;
+}
+
+/*
+** Statistics line of one update class, shared by sysfs and /proc:
+** "<class> <waiting> <updates> <avg wait us> <max wait us> <promoted> <preempted>"
+** Never takes sched_lock, so readers do not delay the panel hand over.
+*/
+#define SCHED_STATS_LINE 160
+static int sched_stats_line (char *buf, size_t size, int c)
+{
+	struct oled_class_stats st;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&sched_stats_seq);
+		st = sched_stats [c];
+	} while (read_seqcount_retry(&sched_stats_seq, seq));
+
+	return scnprintf(buf, size, "%s %u %lu %llu %llu %lu %lu\n",
+			 class_names [c], READ_ONCE(sched_waiting [c]), st.updates,
+			 st.updates ? div64_u64(st.wait_total_us, st.updates) : 0,
+			 st.wait_max_us, st.promoted, st.preempted);
+}
+
+static ssize_t sched_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+        ssize_t len = 0;
+
+        printk(KERN_INFO "oled:sysfs:sched_stats: Read!!!\n");
+        for (int c = 0; c < OLED_NR_CLASSES; c++)
+                len += sched_stats_line(buf + len, PAGE_SIZE - len, c);
+        return len;
+}
+
+/*
+** /proc/oled_driver, one record per seq_file step: the device (this driver
+** binds a single client) followed by one line per update class.
+**
+** Readers never take oled_lock, so polling does not hold up a flush. Scalar
+** state is read with READ_ONCE and is not an atomic snapshot across fields;
+** each class line is a consistent copy (see sched_stats_line).
+*/
+static void *oled_seq_start(struct seq_file *m, loff_t *pos)
+{
+	return *pos <= OLED_NR_CLASSES ? (void *)(uintptr_t)(*pos + 1) : NULL;
+}
+
+static void *oled_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return oled_seq_start(m, pos);
+}
+
+static void oled_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static void oled_seq_show_device(struct seq_file *m)
+{
+	unsigned int first = READ_ONCE(dirty_first), last = READ_ONCE(dirty_last);
+	int state = READ_ONCE(oled_state);
+
+	seq_printf(m, "device: oled@%d-%04x\n", I2C_BUS_AVAILABLE, SSD1315_SLAVE_ADDR);
+	seq_printf(m, "state: %s\n", state != OLED_READY ? state_names [state] :
+		   pm_runtime_status_suspended(&i2c_client_oled->dev) ? "asleep" : "awake");
+	seq_printf(m, "user string on display:%.*s\n", STRING_LIMIT, string_to_display);
+	seq_printf(m, "zoom : %d\nblink: %d\nscroll: %d\n",
+		   READ_ONCE(zoom_on), READ_ONCE(blink_on), READ_ONCE(scroll_on));
+	seq_printf(m, "frame sequence: %lu\n", READ_ONCE(frame_seq));
+	if (first <= last)
+		seq_printf(m, "dirty pages: %u-%u\n", first, last);
+	else
+		seq_puts(m, "dirty pages: none\n");
+	seq_printf(m, "ring pending: %u\nring dropped: %u\nring flush errors: %u\n",
+		   READ_ONCE(ring_hdr->head) - READ_ONCE(ring_tail), READ_ONCE(ring_hdr->dropped),
+		   READ_ONCE(ring_hdr->flush_errors));
+	seq_printf(m, "transfer: %u byte x %u\n", READ_ONCE(xfer_chunk), READ_ONCE(xfer_msgs));
+	seq_printf(m, "first frame us: %lld\n", READ_ONCE(first_frame_us));
+	seq_puts(m, "class waiting updates avg_wait_us max_wait_us promoted preempted\n");
+}
+
+static int oled_seq_show(struct seq_file *m, void *v)
+{
+	int c = (uintptr_t)v - 2;
+	char line [SCHED_STATS_LINE];
+
+	if (c < 0) {
+		oled_seq_show_device(m);
+		return 0;
+	}
+
+	sched_stats_line(line, sizeof(line), c);
+	seq_puts(m, line);
+	return 0;
+}
+
+static const struct seq_operations oled_seq_ops = {
+	.start = oled_seq_start,
+	.next = oled_seq_next,
+	.stop = oled_seq_stop,
+	.show = oled_seq_show,
 };
 /*
 ** This function writes the data into the I2C client
@@ -317,6 +973,139 @@ static void SSD1315_Write(bool is_cmd, unsigned char data)
     ret = I2C_Write(buf, 2);
 }
 
+/*
+** This function sends GDDRAM data bytes using the given transfer shape:
+** messages of at most chunk data bytes each (every one with its own
+** control byte), combined msgs at a time into one i2c_transfer().
+** With preemptible set no message and no transfer crosses a page edge, so
+** a higher class waiting for the panel (see oled_yield) is let in after at
+** most one page; the call then returns early at that page boundary.
+**
+**  Arguments:
+**      data  -> data bytes, starting at a page boundary when preemptible
+**      len   -> number of bytes (at most FRAME_SIZE)
+**      chunk -> data bytes per message
+**      msgs  -> messages per i2c_transfer()
+**      preemptible -> may stop before len bytes are sent
+**
+**  Returns the number of bytes sent or a negative error.
+*/
+static int SSD1315_WriteData(const unsigned char *data, unsigned int len,
+			     unsigned int chunk, unsigned int msgs, bool preemptible)
+{
+    /* serialized by oled_lock */
+    static unsigned char xfer_buf [FRAME_SIZE + XFER_MAX_MSGS];
+    struct i2c_msg msg [XFER_MAX_MSGS];
+    unsigned char *out = xfer_buf;
+    unsigned int n = 0, sent = 0, pending = 0;
+    int ret;
+
+    while (len) {
+        unsigned int size = min(len, chunk);
+        bool page_end;
+
+        if (preemptible)
+            size = min(size, TOTAL_SEG - (sent + pending) % TOTAL_SEG);
+
+        /* one control byte (Co = 0, D/C# = 1) in front of every message */
+        out[0] = 0x40;
+        memcpy(&out[1], data, size);
+        msg[n].addr = i2c_client_oled->addr;
+        msg[n].flags = 0;
+        msg[n].len = size + 1;
+        msg[n].buf = out;
+        n++;
+
+        out += size + 1;
+        data += size;
+        len -= size;
+        pending += size;
+        page_end = (sent + pending) % TOTAL_SEG == 0;
+
+        if (n == msgs || len == 0 || (preemptible && page_end)) {
+            ret = i2c_transfer(i2c_client_oled->adapter, msg, n);
+            if (ret != n)
+                return ret < 0 ? ret : -EIO;
+            n = 0;
+            out = xfer_buf;
+            sent += pending;
+            pending = 0;
+            if (len && preemptible && page_end && oled_higher_waiting ())
+                break;
+        }
+    }
+    return sent;
+}
+
+/*
+** Largest message the adapter accepts, including the control byte.
+*/
+static unsigned int SSD1315_MaxChunk(void)
+{
+    const struct i2c_adapter_quirks *quirks = i2c_client_oled->adapter->quirks;
+
+    if (quirks && quirks->max_write_len && quirks->max_write_len - 1 < FRAME_SIZE)
+        return quirks->max_write_len - 1;
+    return FRAME_SIZE;
+}
+
+/*
+** This function sends a list of commands in a single I2C transfer.
+**
+**  Arguments:
+**      cmds -> control byte 0x00 followed by the command bytes
+**      len  -> total length including the control byte
+** 
+*/
+static int SSD1315_WriteCmds(const unsigned char *cmds, unsigned int len)
+{
+    /*
+    ** With Co = 0 in the control byte every following byte of the
+    ** transfer is taken as a command.
+    */
+    return I2C_Write((unsigned char *)cmds, len);
+}
+
+/*
+** Panel configuration, kept up to date by zoom_in() and fade_blink() so the
+** whole state can be replayed in one burst when the display wakes up.
+*/
+#define CONFIG_ZOOM 27						// index of the zoom in value
+#define CONFIG_BLINK 29						// index of the fade/blink value
+
+static unsigned char config_cmds [] = {
+    0x00, // Control byte, command stream
+    0xAE, // Entire Display OFF
+    0xD5, // Set Display Clock Divide Ratio and Oscillator Frequency
+    0x80, // Default Setting for Display Clock Divide Ratio and Oscillator Frequency that is recommended
+    0xA8, // Set Multiplex Ratio
+    0x3F, // 64 COM lines
+    0xD3, // Set display offset
+    0x00, // 0 offset
+    0x40, // Set first line as the start line of the display
+    0x8D, // Charge pump
+    0x14, // Enable charge dump during display on
+    0x20, // Set memory addressing mode
+    0x02, // Page addressing mode
+    0xA1, // Set segment remap with column address 127 mapped to segment 0
+    0xC8, // Set com output scan direction, scan from com 63 to com 0
+    0xDA, // Set com pins hardware configuration
+    0x12, // Alternative com pin configuration, disable com left/right remap
+    0x81, // Set contrast control
+    0x80, // Set Contrast to 128
+    0xD9, // Set pre-charge period
+    0xF1, // Phase 1 period of 15 DCLK, Phase 2 period of 1 DCLK
+    0xDB, // Set Vcomh deselect level
+    0x20, // Vcomh deselect level ~ 0.77 Vcc
+    0xA4, // Entire display ON, resume to RAM content display
+    0xA6, // Set Display in Normal Mode, 1 = ON, 0 = OFF
+    0x2E, // Deactivate scroll, re-activated by scroll() after the RAM is written
+    0xD6, // Configure zoom in mode
+    0x00, // Zoom in disabled                          (CONFIG_ZOOM)
+    0x23, // Configure fade and blink mode
+    0x00, // Fade and blink disabled                   (CONFIG_BLINK)
+};
+
 /*
 ** This function sends the commands that need to used to Initialize the OLED.
 **
@@ -326,104 +1115,273 @@ static void SSD1315_Write(bool is_cmd, unsigned char data)
 */
 static int SSD1315_DisplayInit(void)
 {
-    msleep(100);               // delay
+    ktime_t deadline = ktime_add_ms(ktime_get(), SSD1315_POWER_ON_MS);
+    int ret;
 
     /*
-    ** Commands to initialize the SSD_1315 OLED Display
+    ** Commands to initialize the SSD_1315 OLED Display.
+    **
+    ** The controller NACKs its address until its supply is stable. Instead
+    ** of always sleeping for the worst case, retry the (single transfer)
+    ** init burst until it is accepted or the datasheet window has passed.
+    ** Display ON is sent by the caller once the first frame is in GDDRAM.
     */
-    SSD1315_Write(true, 0xAE); // Entire Display OFF
-    SSD1315_Write(true, 0xD5); // Set Display Clock Divide Ratio and Oscillator Frequency
-    SSD1315_Write(true, 0x80); // Default Setting for Display Clock Divide Ratio and Oscillator Frequency that is recommended
-    SSD1315_Write(true, 0xA8); // Set Multiplex Ratio
-    SSD1315_Write(true, 0x3F); // 64 COM lines
-    SSD1315_Write(true, 0xD3); // Set display offset
-    SSD1315_Write(true, 0x00); // 0 offset
-    SSD1315_Write(true, 0x40); // Set first line as the start line of the display
-    SSD1315_Write(true, 0x8D); // Charge pump
-    SSD1315_Write(true, 0x14); // Enable charge dump during display on
-    SSD1315_Write(true, 0x20); // Set memory addressing mode
-    SSD1315_Write(true, 0x02); // Page addressing mode
-    SSD1315_Write(true, 0xA1); // Set segment remap with column address 127 mapped to segment 0
-    SSD1315_Write(true, 0xC8); // Set com output scan direction, scan from com 63 to com 0
-    SSD1315_Write(true, 0xDA); // Set com pins hardware configuration
-    SSD1315_Write(true, 0x12); // Alternative com pin configuration, disable com left/right remap
-    SSD1315_Write(true, 0x81); // Set contrast control
-    SSD1315_Write(true, 0x80); // Set Contrast to 128
-    SSD1315_Write(true, 0xD9); // Set pre-charge period
-    SSD1315_Write(true, 0xF1); // Phase 1 period of 15 DCLK, Phase 2 period of 1 DCLK
-    SSD1315_Write(true, 0xDB); // Set Vcomh deselect level
-    SSD1315_Write(true, 0x20); // Vcomh deselect level ~ 0.77 Vcc
-    SSD1315_Write(true, 0xA4); // Entire display ON, resume to RAM content display
-    SSD1315_Write(true, 0xA6); // Set Display in Normal Mode, 1 = ON, 0 = OFF
-    SSD1315_Write(true, 0x2E); // Deactivate scroll
-    SSD1315_Write(true, 0xAF); // Display ON in normal mode
+    while ((ret = SSD1315_WriteCmds(config_cmds, sizeof(config_cmds))) < 0) {
+        if (ktime_after(ktime_get(), deadline))
+            return ret;
+        usleep_range(1000, 2000);
+    }
     
     return 0;
 }
 
-static void clear_display (void)
+static const unsigned char page_mode_cmds [] = {
+	0x00,			// Control byte, command stream
+	0x20, 0x02,		// Back to page addressing mode
+};
+
+static const unsigned char display_on_cmds [] = {
+	0x00,			// Control byte, command stream
+	0xAF,			// Display ON in normal mode
+};
+
+/* horizontal addressing window over pages first - last, all columns */
+static int send_window (unsigned int first_page, unsigned int last_page)
 {
-	char page = PAGE_0;
-	for (int i = 0; i < CHARS_COLS_LENGTH; i++) {
+	const unsigned char window_cmds [] = {
+		0x00,			// Control byte, command stream
+		0x20, 0x00,		// Horizontal addressing mode
+		0x21, 0x00, TOTAL_SEG - 1,	// Column range 0 - 127
+		0x22, first_page, last_page,	// Page range
+	};
 
-		SSD1315_Write(true, page++); // Setting Page address (page 0)
-		SSD1315_Write(true, 0x00); // Setting Page address (higher nibble for col start address)
-		SSD1315_Write(true, 0x10); // Setting Page address (lower nibble for col start address)
-					   
-		for(unsigned int j = 0; j < TOTAL_SEG; j++)
-		{
-			SSD1315_Write(false, 0x00);
+	return SSD1315_WriteCmds(window_cmds, sizeof(window_cmds));
+}
+
+/*
+** This function sends the given range of pages from frame_buffer to the OLED.
+** The pages are written as one run in horizontal addressing mode, split
+** according to xfer_chunk / xfer_msgs. Below OLED_CLASS_ALERT the transfers
+** end at every page edge and the run is cut short there when a higher class
+** is waiting, which then gets the panel before the rest is sent (see
+** oled_yield). Alert holders, probe among them, send the range unsplit.
+** Returns -EINTR if the caller was killed while handing over the panel and
+** the I2C error if the pages did not reach the panel.
+*/
+static int flush_pages (unsigned int first_page, unsigned int last_page)
+{
+	bool preemptible = oled_preemptible ();
+	unsigned int chunk = min(xfer_chunk, SSD1315_MaxChunk());
+	unsigned int msgs = xfer_msgs;
+	unsigned int page = first_page;
+	int ret, err;
+
+	ret = send_window (first_page, last_page);
+	if (ret < 0)
+		goto out;
+	while (page <= last_page) {
+		const unsigned char *data = &frame_buffer [page * TOTAL_SEG];
+		unsigned int len = (last_page - page + 1) * TOTAL_SEG;
+
+		ret = SSD1315_WriteData(data, len, chunk, msgs, preemptible);
+
+		/* retry this run one page per message */
+		if (ret < 0 && (chunk > TOTAL_SEG || msgs > 1)) {
+			int failed = ret;
+
+			printk (KERN_WARNING "oled: %u byte x %u transfer failed (%d), retrying %d x 1\n",
+				chunk, msgs, ret, TOTAL_SEG);
+			ret = send_window (page, last_page);
+			if (ret >= 0)
+				ret = SSD1315_WriteData(data, len, TOTAL_SEG, 1, preemptible);
+
+			/*
+			** Only an adapter that refused the shape itself makes it the
+			** default, a NACK may just have been a glitch.
+			*/
+			if (ret >= 0 && (failed == -EOPNOTSUPP || failed == -EINVAL)) {
+				printk (KERN_WARNING "oled: adapter rejects %u byte x %u transfers, using %d x 1\n",
+					chunk, msgs, TOTAL_SEG);
+				xfer_chunk = chunk = TOTAL_SEG;
+				xfer_msgs = msgs = 1;
+			}
 		}
+		if (ret < 0)
+			goto out;
+		page += ret / TOTAL_SEG;
+
+		/* someone else drew in between, the addressing window is gone */
+		if (page <= last_page) {
+			ret = oled_yield ();
+			if (ret < 0)
+				return ret;		// the panel is not ours any more
+			if (ret && (ret = send_window (page, last_page)) < 0)
+				goto out;
+		}
+	}
+	ret = 0;
+out:
+	/* back to page mode also after a failed run, the bus may be fine again */
+	err = SSD1315_WriteCmds(page_mode_cmds, sizeof(page_mode_cmds));
+	if (ret == 0 && err < 0)
+		ret = err;
+	if (ret < 0) {
+		printk (KERN_ERR "oled: flush of pages %u - %u failed (%d)\n", first_page, last_page, ret);
+		return ret;
 	}
+	WRITE_ONCE(frame_seq, frame_seq + 1);
+	return 0;
+}
+
+/*
+** This function sends the whole frame_buffer to the OLED.
+*/
+static int flush_frame (void)
+{
+	return flush_pages (0, TOTAL_PAGES - 1);
+}
+
+/*
+** This function measures the throughput of a range of transfer shapes by
+** rewriting the current frame (so nothing changes on the panel) and keeps
+** the fastest one in xfer_chunk / xfer_msgs. Called with the panel locked
+** and the panel awake; higher classes get the panel between the rounds.
+*/
+static int oled_calibrate (void)
+{
+	static const unsigned int msgs_tried [] = { 1, 4, XFER_MAX_MSGS };
+	static const unsigned char frame_window_cmds [] = {
+		0x00,			// Control byte, command stream
+		0x20, 0x00,		// Horizontal addressing mode
+		0x21, 0x00, TOTAL_SEG - 1,	// Column range 0 - 127
+		0x22, 0x00, TOTAL_PAGES - 1,	// Page range 0 - 7
+	};
+	unsigned int max_chunk = SSD1315_MaxChunk();
+	unsigned int max_msgs = XFER_MAX_MSGS;
+	const struct i2c_adapter_quirks *quirks = i2c_client_oled->adapter->quirks;
+	unsigned int best_rate = 0, best_chunk = TOTAL_SEG, best_msgs = 1;
+
+	if (quirks && quirks->max_num_msgs)
+		max_msgs = min_t(unsigned int, quirks->max_num_msgs, XFER_MAX_MSGS);
+
+	calibrate_shapes = 0;
+	for (unsigned int chunk = XFER_MIN_CHUNK; chunk <= max_chunk; chunk *= 2) {
+		for (unsigned int i = 0; i < ARRAY_SIZE(msgs_tried); i++) {
+			unsigned int msgs = msgs_tried [i];
+			unsigned int rate = 0;
+			ktime_t start;
+			s64 elapsed = 0;
+			int ret = 0;
+
+			if (msgs > max_msgs)
+				continue;
+			/* the previous count already sent the frame in one transfer */
+			if (i > 0 && DIV_ROUND_UP(FRAME_SIZE, chunk) <= msgs_tried [i - 1])
+				continue;
+
+			for (unsigned int round = 0; round < CALIBRATE_ROUNDS && ret >= 0; round++) {
+				/* let waiting updates in between rounds, not timed */
+				if (oled_yield () < 0)
+					return -EINTR;
+				/* every round re-sends the window, also after a handover */
+				start = ktime_get();
+				SSD1315_WriteCmds(frame_window_cmds, sizeof(frame_window_cmds));
+				ret = SSD1315_WriteData(frame_buffer, FRAME_SIZE, chunk, msgs, false);
+				elapsed += ktime_us_delta(ktime_get(), start);
+			}
+			if (ret >= 0 && elapsed > 0)
+				rate = div64_u64((u64)CALIBRATE_ROUNDS * FRAME_SIZE * USEC_PER_SEC, elapsed);
+
+			if (calibrate_shapes < CALIBRATE_MAX_SHAPES) {
+				calibrate_result [calibrate_shapes].chunk = chunk;
+				calibrate_result [calibrate_shapes].msgs = msgs;
+				calibrate_result [calibrate_shapes].rate = rate;
+				calibrate_shapes++;
+			}
+			if (rate > best_rate) {
+				best_rate = rate;
+				best_chunk = chunk;
+				best_msgs = msgs;
+			}
+		}
+	}
+	SSD1315_WriteCmds(page_mode_cmds, sizeof(page_mode_cmds));
+
+	if (best_rate == 0) {
+		printk (KERN_ERR "oled: calibration failed, no transfer shape worked\n");
+		return -EIO;
+	}
+	xfer_chunk = best_chunk;
+	xfer_msgs = best_msgs;
+	printk (KERN_INFO "oled: calibrated to %u byte x %u messages, %u bytes/s\n",
+		best_chunk, best_msgs, best_rate);
+	return 0;
+}
+
+static int clear_display (void)
+{
+	int ret;
+
+	memset(frame_buffer, 0x00, FRAME_SIZE);
+	frame_valid = true;
+	ret = flush_frame ();
+	if (ret)
+		return ret;
 	printk ("display cleared\n");
+	return 0;
+}
+/*
+** Font entry for a character, blank for NEWLINE and anything outside the font.
+*/
+static const uint8_t *glyph (int ascii)
+{
+	if (ascii < ' ' || ascii >= ' ' + ARRAY_SIZE(FONTS))
+		return FONTS [0];
+	return FONTS [ascii - ' '];
 }
+
 /*
-** This function Fills the complete OLED with this data byte.
+** This function renders the string into frame_buffer, 16 characters per
+** page starting at page 0, and returns the number of bytes rendered.
 **
 **  Arguments:
 **      data  -> Data to be filled in the OLED
 ** 
 */
-static void draw (char *data)
+static unsigned int render_string (const char *data)
 {
-	SSD1315_Write(true, PAGE_0); // Setting Page address (page 0)
-	SSD1315_Write(true, 0x00); // Setting Page address (higher nibble for col start address)
-	SSD1315_Write(true, 0x10); // Setting Page address (lower nibble for col start address)
-
 	unsigned int i = 0;
-	unsigned char page = PAGE_0;
-	unsigned int n_char = 0;
-	unsigned int n = 1;
+	unsigned int pos = 0;
 
 	while (data [i] != '\0') {
-		n_char = (i + 1) * CHARS_COLS_LENGTH;
-
-		if (((n * TOTAL_SEG) - n_char) == -CHARS_COLS_LENGTH) {
-			page++;
-			printk ("%c\n", page);
-			if (page > MAX_PAGE) {
-				printk (KERN_ALERT "oled@3c: Data exceeding 1kB\n");
-				return;
-			}
-			SSD1315_Write(true, page); // Setting Page address (page 0)
-			SSD1315_Write(true, 0x00); // Setting Page address (higher nibble for col start address)
-			SSD1315_Write(true, 0x10); // Setting Page address (lower nibble for col start address)
-			n++;
+		if (pos + CHARS_COLS_LENGTH > FRAME_SIZE) {
+			printk (KERN_ALERT "oled@3c: Data exceeding 1kB\n");
+			break;
 		}
 
-		int ascii = data [i++];
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (ascii == NEWLINE) 
-				SSD1315_Write(false, FONTS [0][j]);
-			else 
-				SSD1315_Write(false, FONTS [ascii - 32][j]);
-		}
+		memcpy(&frame_buffer [pos], glyph (data [i++]), CHARS_COLS_LENGTH);
+		pos += CHARS_COLS_LENGTH;
 	}
+
+	frame_valid = true;
+	return pos;
+}
+
+/*
+** This function draws the string and sends the touched pages to the OLED.
+*/
+static int draw (char *data)
+{
+	unsigned int pos = render_string (data);
+
+	if (pos)
+		return flush_pages (0, (pos - 1) / TOTAL_SEG);
+	return 0;
 }
 
 static void scroll (bool scroll)
 {
+	scroll_on = scroll;
 	if (!scroll) {
                 SSD1315_Write(true, 0x2E);		//Deactivate Scroll
 		return;
@@ -440,6 +1398,8 @@ static void scroll (bool scroll)
 
 static void fade_blink (bool blink)
 {
+	config_cmds [CONFIG_BLINK] = blink ? 0x30 : 0x00;
+	blink_on = blink;
 	SSD1315_Write(true, 0x23);		//Configure fade and blink mode
 	if (!blink) {
 		SSD1315_Write(true, 0x00);		// Disable fade and blink mode
@@ -450,6 +1410,8 @@ static void fade_blink (bool blink)
 
 static void zoom_in (bool zoom_in)
 {
+	config_cmds [CONFIG_ZOOM] = zoom_in ? 0x01 : 0x00;
+	zoom_on = zoom_in;
 	SSD1315_Write(true, 0xD6);		//Configure zoom in mode
 	if (!zoom_in) {
 		SSD1315_Write(true, 0x00);		//disable zoom in
@@ -458,20 +1420,286 @@ static void zoom_in (bool zoom_in)
 	SSD1315_Write(true, 0x01);		//enable zoom in
 }
 
+static void mark_dirty (unsigned int first_page, unsigned int last_page)
+{
+	dirty_first = min(dirty_first, first_page);
+	dirty_last = max(dirty_last, last_page);
+}
+
+/*
+** This function executes one ring record against frame_buffer. Records come
+** from userspace, so every coordinate is clipped to the panel.
+** Returns -EINVAL for a malformed record and the flush error of a COMMIT.
+*/
+static int ring_exec (const struct oled_ring_cmd *cmd)
+{
+	switch (cmd->op) {
+		case OLED_RING_NOP:
+			return 0;
+		case OLED_RING_TEXT: {
+			unsigned int pos = cmd->y * TOTAL_SEG + cmd->x;
+			unsigned int len = min_t(unsigned int, cmd->len, OLED_RING_TEXT_MAX);
+			unsigned int i;
+
+			if (cmd->x >= TOTAL_SEG || cmd->y >= TOTAL_PAGES)
+				return -EINVAL;
+			for (i = 0; i < len && pos + CHARS_COLS_LENGTH <= FRAME_SIZE; i++) {
+				memcpy(&frame_buffer [pos], glyph (cmd->text [i]), CHARS_COLS_LENGTH);
+				pos += CHARS_COLS_LENGTH;
+			}
+			if (i)
+				mark_dirty (cmd->y, (pos - 1) / TOTAL_SEG);
+			frame_valid = true;
+			return 0;
+		}
+		case OLED_RING_RECT: {
+			unsigned int x1 = min_t(unsigned int, cmd->x + cmd->w, TOTAL_SEG);
+			unsigned int y1 = min_t(unsigned int, cmd->y + cmd->h, TOTAL_PAGES * 8);
+
+			if (cmd->value > OLED_RECT_INVERT)
+				return -EINVAL;
+			if (cmd->x >= x1 || cmd->y >= y1)
+				return 0;
+			for (unsigned int page = cmd->y / 8; page <= (y1 - 1) / 8; page++) {
+				unsigned int top = max(cmd->y, page * 8) - page * 8;
+				unsigned int bottom = min(y1, page * 8 + 8) - page * 8;
+				unsigned char mask = (0xFF << top) & (0xFF >> (8 - bottom));
+				unsigned char *col = &frame_buffer [page * TOTAL_SEG];
+
+				for (unsigned int x = cmd->x; x < x1; x++) {
+					if (cmd->value == OLED_RECT_CLEAR)
+						col [x] &= ~mask;
+					else if (cmd->value == OLED_RECT_SET)
+						col [x] |= mask;
+					else
+						col [x] ^= mask;
+				}
+			}
+			mark_dirty (cmd->y / 8, (y1 - 1) / 8);
+			frame_valid = true;
+			return 0;
+		}
+		case OLED_RING_COMMIT:
+			if (dirty_first <= dirty_last) {
+				int ret = flush_pages (dirty_first, dirty_last);
+
+				/* on failure the pages stay dirty for the next COMMIT */
+				if (ret)
+					return ret;
+				dirty_first = TOTAL_PAGES;
+				dirty_last = 0;
+			}
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+** Flush worker: drains the command ring. Before going idle need_wakeup is
+** set and head re-checked, so a record published concurrently either is
+** seen here or makes the producer ring the doorbell.
+*/
+static void ring_work_fn(struct work_struct *work)
+{
+	unsigned int budget = OLED_RING_ENTRIES;
+	u32 head, tail;
+	int ret;
+
+	if (oled_begin_update (OLED_CLASS_STREAM, 0)) {
+		WRITE_ONCE(ring_hdr->need_wakeup, 1);	// retry on the next doorbell
+		return;
+	}
+
+	/* never trust ring_hdr->tail, the producer can write the whole header */
+	tail = ring_tail;
+	for (;;) {
+		head = smp_load_acquire(&ring_hdr->head);
+		if (head - tail > OLED_RING_ENTRIES) {
+			/* producer corrupted the indices, drop what is there */
+			printk (KERN_WARNING "oled: ring head %u / tail %u out of range\n", head, tail);
+			ring_hdr->dropped += head - tail;
+			tail = ring_tail = head;
+			smp_store_release(&ring_hdr->tail, tail);
+		}
+
+		while (tail != head && budget) {
+			struct oled_ring_cmd cmd;
+
+			/* private copy, the producer may scribble over the slot */
+			memcpy(&cmd, &ring_cmds [tail & (OLED_RING_ENTRIES - 1)], sizeof(cmd));
+			ret = ring_exec (&cmd);
+			if (ret == -EINVAL)
+				ring_hdr->dropped++;
+			else if (ret)
+				ring_hdr->flush_errors++;
+			tail++;
+			budget--;
+			ring_tail = tail;
+			smp_store_release(&ring_hdr->tail, tail);
+		}
+
+		if (!budget) {
+			/* let other clients at the panel, then continue */
+			schedule_work(&ring_work);
+			break;
+		}
+
+		WRITE_ONCE(ring_hdr->need_wakeup, 1);
+		smp_mb();
+		if (READ_ONCE(ring_hdr->head) == tail)
+			break;
+		WRITE_ONCE(ring_hdr->need_wakeup, 0);
+	}
+
+	oled_end_update ();
+}
+
+/*
+** Runtime PM: called by the PM core once the panel has been idle for
+** autosuspend_delay_ms. GDDRAM content is retained while the panel sleeps.
+*/
+static int oled_runtime_suspend(struct device *dev)
+{
+	static const unsigned char sleep_cmds [] = {
+		0x00,		// Control byte, command stream
+		0xAE,		// Entire Display OFF
+		0x8D,		// Charge pump
+		0x10,		// Disable charge pump
+	};
+
+	SSD1315_WriteCmds(sleep_cmds, idle_pump_off ? sizeof(sleep_cmds) : 2);
+	dev_dbg(dev, "display asleep\n");
+	return 0;
+}
+
+/*
+** Runtime PM: called on the first update after the panel went to sleep.
+** The cached configuration goes out as one burst; the frame buffer is only
+** written back when the panel may have lost power (system suspend).
+** A failure fails pm_runtime_resume_and_get(), and with it the update.
+*/
+static int oled_runtime_resume(struct device *dev)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = SSD1315_WriteCmds(config_cmds, sizeof(config_cmds));
+	if (ret < 0)
+		return ret;
+	if (ram_lost) {
+		ret = flush_frame ();
+		if (ret < 0)
+			return ret;
+		ram_lost = false;
+	}
+	if (scroll_on)
+		scroll (true);
+	ret = SSD1315_WriteCmds(display_on_cmds, sizeof(display_on_cmds));
+	if (ret < 0)
+		return ret;
+
+	dev_dbg(dev, "display awake in %lld us\n", ktime_us_delta(ktime_get(), start));
+	return 0;
+}
+
+static int oled_suspend(struct device *dev)
+{
+	int ret = pm_runtime_force_suspend(dev);
+
+	ram_lost = true;
+	return ret;
+}
+
+static int oled_resume(struct device *dev)
+{
+	return pm_runtime_force_resume(dev);
+}
+
+static const struct dev_pm_ops oled_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(oled_suspend, oled_resume)
+	SET_RUNTIME_PM_OPS(oled_runtime_suspend, oled_runtime_resume, NULL)
+};
+
+/*
+** Panel bring-up, queued by oled_probe() so neither probe nor module load
+** waits for the power-on window: init burst, first frame, display on, then
+** runtime PM. Updates get -EAGAIN until it is done, -ENODEV if it failed.
+*/
+static void panel_init_work_fn(struct work_struct *work)
+{
+	struct device *dev = &i2c_client_oled->dev;
+	ktime_t start = ktime_get();
+	int ret;
+
+	/* as alert: the first frame is never preempted, it goes out in one run */
+	ret = oled_lock (OLED_CLASS_ALERT, 0);
+	if (ret)
+		goto fail;
+
+	/* start with all graphic modes off */
+	config_cmds [CONFIG_ZOOM] = 0x00;
+	config_cmds [CONFIG_BLINK] = 0x00;
+	zoom_on = blink_on = scroll_on = 0;
+
+	ret = SSD1315_DisplayInit();
+	if (ret < 0) {
+		oled_unlock ();
+		goto fail;
+	}
+
+	/*
+	** First frame: the content from before an unbind/rebind if there is
+	** any, the instruction splash otherwise. Rendered in memory and sent
+	** as a single transfer before the display is switched on.
+	*/
+	if (!frame_valid) {
+		char *instruction = "Use test app or sysfs interface to display your string.";
+
+		memset(frame_buffer, 0x00, FRAME_SIZE);
+		render_string (instruction);
+	}
+	ret = flush_frame ();
+	if (ret == 0)
+		ret = SSD1315_WriteCmds(display_on_cmds, sizeof(display_on_cmds));
+	oled_unlock ();
+	if (ret < 0)
+		goto fail;
+
+	first_frame_us = ktime_us_delta(ktime_get(), load_time);
+	dev_info(dev, "first frame %lld us after load (init %lld us)\n",
+		 first_frame_us, ktime_us_delta(ktime_get(), start));
+	pr_info("OLED Probed!!!\n");
+
+	/* the panel is on now, let it sleep after idle_timeout_ms */
+	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, idle_timeout_ms);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_get_noresume(dev);
+	pm_runtime_enable(dev);
+	/* only now pm_runtime_resume_and_get() in oled_begin_update() can succeed */
+	WRITE_ONCE(oled_state, OLED_READY);
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+
+	if (calibrate_on_probe && oled_begin_update (OLED_CLASS_BULK, 0) == 0) {
+		oled_calibrate ();
+		oled_end_update ();
+	}
+	return;
+
+fail:
+	WRITE_ONCE(oled_state, OLED_FAILED);
+	dev_err(dev, "display does not answer (%d)\n", ret);
+}
+
 /*
 ** This function getting called when the slave has been found
 ** Note : This will be called only once when we load the driver.
 */
 static int oled_probe(struct i2c_client *client)
 {
-	SSD1315_DisplayInit();
-	clear_display ();
-	char *instruction = "Use test app or sysfs interface to display your string.";
-	draw (instruction);
-	pr_info("OLED Probed!!!\n");
-	fade_blink (false);
-	scroll (false);
-	zoom_in (false);
+	WRITE_ONCE(oled_state, OLED_PROBING);	// may be a rebind after a failure
+	schedule_work(&panel_init_work);
 	return 0;
 }
 
@@ -481,10 +1709,28 @@ static int oled_probe(struct i2c_client *client)
 */
 static void oled_remove(struct i2c_client *client)
 {   
-    clear_display ();
-    SSD1315_Write(true, 0x23);		//Configure fade and blink mode
-    SSD1315_Write(true, 0x00);		//disable zoom in
-    SSD1315_Write(true, 0x2E);		//Deactivate Scroll
+    cancel_work_sync(&panel_init_work);
+    if (READ_ONCE(oled_state) != OLED_READY) {
+        /* bring-up never finished, runtime PM is not enabled */
+        WRITE_ONCE(oled_state, OLED_FAILED);
+        pr_info("OLED Removed!!!\n");
+        return;
+    }
+    WRITE_ONCE(oled_state, OLED_FAILED);
+    pm_runtime_get_sync(&client->dev);
+    /* killed while waiting: leave the panel as it is */
+    if (oled_lock (OLED_CLASS_INTERACTIVE, 0) == 0) {
+        /* frame_buffer is kept, it becomes the first frame if the panel is probed again */
+        SSD1315_Write(true, 0x23);		//Configure fade and blink mode
+        SSD1315_Write(true, 0x00);		//disable zoom in
+        SSD1315_Write(true, 0x2E);		//Deactivate Scroll
+        SSD1315_Write(true, 0xAE);		//Entire Display OFF
+        oled_unlock ();
+    }
+    pm_runtime_disable(&client->dev);
+    pm_runtime_dont_use_autosuspend(&client->dev);
+    pm_runtime_set_suspended(&client->dev);
+    pm_runtime_put_noidle(&client->dev);
     pr_info("OLED Removed!!!\n");
 }
 
@@ -504,6 +1750,7 @@ static struct i2c_driver oled_driver = {
         .driver = {
             .name   = SLAVE_DEVICE_NAME,
             .owner  = THIS_MODULE,
+            .pm     = &oled_pm_ops,
         },
         .probe          = oled_probe,
         .remove         = oled_remove,
@@ -523,6 +1770,19 @@ static struct i2c_board_info oled_i2c_board_info = {
 static int __init oled_driver_init(void)
 {
 	int ret = -1;
+	load_time = ktime_get();
+
+	ring = vmalloc_user(PAGE_ALIGN(OLED_RING_MAP_SIZE));
+	if (ring == NULL)
+		return -ENOMEM;
+	ring_hdr = ring;
+	ring_cmds = ring + OLED_RING_HDR_SIZE;
+	ring_hdr->magic = OLED_RING_MAGIC;
+	ring_hdr->version = OLED_RING_VERSION;
+	ring_hdr->entries = OLED_RING_ENTRIES;
+	ring_hdr->entry_size = sizeof(struct oled_ring_cmd);
+	ring_hdr->need_wakeup = 1;
+
 	i2c_adapter = i2c_get_adapter(I2C_BUS_AVAILABLE);
 	if( i2c_adapter != NULL ) {
 	i2c_client_oled = i2c_new_client_device(i2c_adapter, &oled_i2c_board_info);
@@ -536,6 +1796,7 @@ static int __init oled_driver_init(void)
 	/* Allocating Major number */
 	if((alloc_chrdev_region(&dev, 0, 1, "oled_device")) <0) {
 		printk(KERN_INFO "Cannot allocate major number\n");
+		vfree(ring);
 		return -1;
 	}
 	printk(KERN_INFO "Major = %d Minor = %d \n",MAJOR(dev), MINOR(dev));
@@ -563,7 +1824,7 @@ static int __init oled_driver_init(void)
                 goto r_sysfs;
         }
 
-	pd_entry = proc_create(procfs_name, 0, NULL, &proc_fops);
+	pd_entry = proc_create_seq(procfs_name, 0444, NULL, &oled_seq_ops);
 
 	if(pd_entry == NULL) {
 		remove_proc_entry(procfs_name, NULL);
@@ -586,6 +1847,7 @@ r_class:
 cdev_del(&oled_cdev);
 r_cdev:
 unregister_chrdev_region(dev,1);
+vfree(ring);
 return -1;
 
 }
@@ -595,6 +1857,7 @@ return -1;
 */
 static void __exit oled_driver_exit(void)
 {
+	cancel_work_sync(&ring_work);
 	i2c_unregister_device(i2c_client_oled);
 	i2c_del_driver(&oled_driver);
         kobject_put(kobj_ref);
@@ -604,6 +1867,7 @@ static void __exit oled_driver_exit(void)
 	class_destroy(dev_class);
 	cdev_del(&oled_cdev);
 	unregister_chrdev_region(dev, 1);
+	vfree(ring);
 	pr_info("Driver Removed!!!\n");
 }
 
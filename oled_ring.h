@@ -0,0 +1,69 @@
+#ifndef __OLED_RING_H__
+#define __OLED_RING_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Shared memory command ring of /dev/oled_device
+// -----------------------------------
+// mmap(NULL, OLED_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+// maps a header page followed by OLED_RING_ENTRIES command records.
+//
+// Single producer (userspace) / single consumer (driver flush worker).
+// Only one open file may map the ring, mmap() from another one fails with
+// EBUSY until the producer's file is closed and all its mappings are gone.
+//  - the producer fills records at head, then publishes head (release)
+//  - the consumer executes records at tail, then publishes tail (release)
+//  - once the consumer has drained the ring it sets need_wakeup; a producer
+//    that sees need_wakeup after publishing head issues OLED_RING_DOORBELL.
+// Indices are free running, the slot is index & (OLED_RING_ENTRIES - 1).
+
+#define OLED_RING_MAGIC    0x4F4C5247		// "OLRG"
+#define OLED_RING_VERSION  1
+#define OLED_RING_ENTRIES  256			// power of 2
+#define OLED_RING_HDR_SIZE 4096			// records start at this offset
+#define OLED_RING_TEXT_MAX 56
+
+#define OLED_RING_DOORBELL _IO('a', 'f')
+
+// record opcodes
+enum {
+	OLED_RING_NOP,
+	OLED_RING_TEXT,		// text at column x, page y (8x8 font, at most OLED_RING_TEXT_MAX chars)
+	OLED_RING_RECT,		// pixel rectangle x, y, w, h; value = OLED_RECT_*
+	OLED_RING_COMMIT	// send everything drawn since the last commit to the panel
+};
+
+enum {
+	OLED_RECT_CLEAR,
+	OLED_RECT_SET,
+	OLED_RECT_INVERT
+};
+
+struct oled_ring_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 entries;
+	__u32 entry_size;
+	__u32 head __attribute__((aligned(64)));	// written by the producer only
+	__u32 tail __attribute__((aligned(64)));	// written by the consumer only
+	__u32 need_wakeup;				// set by the consumer, cleared by the producer that rings
+	__u32 dropped;					// malformed records skipped by the consumer
+	__u32 flush_errors;				// COMMITs that failed on the bus, retried by the next COMMIT
+};
+
+struct oled_ring_cmd {
+	__u8 op;
+	__u8 value;
+	__u8 len;		// OLED_RING_TEXT: number of chars in text
+	__u8 pad;
+	__u8 x;
+	__u8 y;
+	__u8 w;
+	__u8 h;
+	char text [OLED_RING_TEXT_MAX];
+};
+
+#define OLED_RING_MAP_SIZE (OLED_RING_HDR_SIZE + OLED_RING_ENTRIES * sizeof(struct oled_ring_cmd))
+
+#endif
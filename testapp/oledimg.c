@@ -0,0 +1,452 @@
+/*
+** oledimg - convert PGM/PPM images to SSD1315 frames and push them to the OLED.
+**
+** The image is scaled to 128x64 (area average), dithered and packed into the
+** page-major GDDRAM layout used by the driver: byte [page * 128 + column],
+** bit 0 = top row of the page. Frames are written with pwrite() at offset 0
+** of /dev/oled_device.
+**
+** Any number of binary PNM frames (P5/P6) can be concatenated on stdin, e.g.
+**   ffmpeg -i clip.mp4 -vf scale=128:64 -f image2pipe -vcodec pgm - | oledimg
+** so the tool can also be used to play video-like streams.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define OLED_DEVICE "/dev/oled_device"
+
+#define OLED_WIDTH 128
+#define OLED_HEIGHT 64
+#define OLED_PAGES (OLED_HEIGHT / 8)
+#define FRAME_SIZE (OLED_PAGES * OLED_WIDTH)
+
+enum {
+	DITHER_ORDERED,
+	DITHER_FLOYD_STEINBERG,
+	DITHER_NONE
+};
+
+/* 8x8 Bayer matrix, one row per row of a GDDRAM page */
+static const uint8_t bayer [8][8] = {
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+/*
+** Per-row threshold vectors for the threshold/pack step. A pixel is lit when
+** its gray value is greater than the threshold. 16 columns wide so one row is
+** exactly one SIMD register.
+*/
+static uint8_t thresholds [8][16] __attribute__((aligned(16)));
+
+/* source image, converted to 8 bit gray */
+struct image {
+	int width;
+	int height;
+	uint8_t *gray;
+	size_t capacity;
+	uint8_t *row;		// raw row buffer for RGB / 16 bit input
+	size_t row_capacity;
+};
+
+/* precomputed source spans for the area scaler */
+struct scaler {
+	int src_width;
+	int src_height;
+	int x0 [OLED_WIDTH], x1 [OLED_WIDTH];
+	int y0 [OLED_HEIGHT], y1 [OLED_HEIGHT];
+};
+
+static void init_thresholds (int dither)
+{
+	for (int k = 0; k < 8; k++)
+		for (int c = 0; c < 16; c++) {
+			if (dither == DITHER_ORDERED)
+				thresholds [k][c] = bayer [k][c & 7] * 4 + 2;
+			else
+				thresholds [k][c] = 127;
+		}
+}
+
+/* skips white space and '#' comments in a PNM header */
+static int pnm_skip (FILE *fp)
+{
+	int c;
+
+	while ((c = getc(fp)) != EOF) {
+		if (c == '#') {
+			while ((c = getc(fp)) != EOF && c != '\n')
+				;
+		}
+		else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			ungetc(c, fp);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int pnm_number (FILE *fp, int *value)
+{
+	if (pnm_skip (fp) < 0 || fscanf(fp, "%d", value) != 1 || *value <= 0)
+		return -1;
+	return 0;
+}
+
+/*
+** Reads one binary PGM (P5) or PPM (P6) frame from fp into img->gray.
+** Returns 1 on success, 0 on clean end of stream, -1 on error.
+*/
+static int read_pnm (FILE *fp, struct image *img)
+{
+	int magic0, magic1, maxval, channels, bytes;
+	size_t row_bytes;
+
+	if (pnm_skip (fp) < 0)
+		return 0;
+	magic0 = getc(fp);
+	magic1 = getc(fp);
+	if (magic0 != 'P' || (magic1 != '5' && magic1 != '6')) {
+		fprintf(stderr, "oledimg: only binary PGM (P5) and PPM (P6) are supported\n");
+		return -1;
+	}
+	channels = (magic1 == '6') ? 3 : 1;
+
+	if (pnm_number (fp, &img->width) || pnm_number (fp, &img->height) ||
+	    pnm_number (fp, &maxval) || maxval > 65535) {
+		fprintf(stderr, "oledimg: bad PNM header\n");
+		return -1;
+	}
+	getc(fp);	// single white space before the raster
+
+	if ((size_t)img->width * img->height > img->capacity) {
+		img->capacity = (size_t)img->width * img->height;
+		free(img->gray);
+		img->gray = malloc(img->capacity);
+		if (img->gray == NULL)
+			return -1;
+	}
+
+	bytes = (maxval > 255) ? 2 : 1;
+	row_bytes = (size_t)img->width * channels * bytes;
+	if (row_bytes > img->row_capacity) {
+		img->row_capacity = row_bytes;
+		free(img->row);
+		img->row = malloc(row_bytes);
+		if (img->row == NULL)
+			return -1;
+	}
+
+	for (int y = 0; y < img->height; y++) {
+		uint8_t *dst = img->gray + (size_t)y * img->width;
+
+		if (channels == 1 && bytes == 1) {
+			if (fread(dst, 1, img->width, fp) != (size_t)img->width)
+				goto short_read;
+		}
+		else {
+			const uint8_t *src = img->row;
+
+			if (fread(img->row, 1, row_bytes, fp) != row_bytes)
+				goto short_read;
+			for (int x = 0; x < img->width; x++) {
+				/* 16 bit samples are big endian, keep the MSB */
+				if (channels == 1)
+					dst [x] = src [0];
+				else
+					dst [x] = (77 * src [0] + 150 * src [bytes] + 29 * src [2 * bytes]) >> 8;	// BT.601 luma
+				src += channels * bytes;
+			}
+		}
+	}
+
+	/* rescale to 0..255 when maxval is not a full range */
+	if (maxval != 255 && maxval != 65535) {
+		unsigned int full = (maxval > 255) ? (maxval >> 8) : maxval;
+		size_t n = (size_t)img->width * img->height;
+
+		for (size_t i = 0; i < n; i++) {
+			unsigned int v = img->gray [i] * 255 / full;
+			img->gray [i] = v > 255 ? 255 : v;
+		}
+	}
+	return 1;
+
+short_read:
+	fprintf(stderr, "oledimg: truncated image data\n");
+	return -1;
+}
+
+static void init_scaler (struct scaler *sc, int width, int height)
+{
+	sc->src_width = width;
+	sc->src_height = height;
+	for (int x = 0; x < OLED_WIDTH; x++) {
+		sc->x0 [x] = x * width / OLED_WIDTH;
+		sc->x1 [x] = (x + 1) * width / OLED_WIDTH;
+		if (sc->x1 [x] <= sc->x0 [x])
+			sc->x1 [x] = sc->x0 [x] + 1;
+	}
+	for (int y = 0; y < OLED_HEIGHT; y++) {
+		sc->y0 [y] = y * height / OLED_HEIGHT;
+		sc->y1 [y] = (y + 1) * height / OLED_HEIGHT;
+		if (sc->y1 [y] <= sc->y0 [y])
+			sc->y1 [y] = sc->y0 [y] + 1;
+	}
+}
+
+/* area-average (or nearest, when upscaling) resample to 128x64 */
+static void scale (const struct scaler *sc, const uint8_t *src, uint8_t *dst)
+{
+	uint32_t sum [OLED_WIDTH];
+
+	for (int y = 0; y < OLED_HEIGHT; y++) {
+		int rows = sc->y1 [y] - sc->y0 [y];
+
+		memset(sum, 0, sizeof(sum));
+		for (int sy = sc->y0 [y]; sy < sc->y1 [y]; sy++) {
+			const uint8_t *line = src + (size_t)sy * sc->src_width;
+
+			for (int x = 0; x < OLED_WIDTH; x++)
+				for (int sx = sc->x0 [x]; sx < sc->x1 [x]; sx++)
+					sum [x] += line [sx];
+		}
+		for (int x = 0; x < OLED_WIDTH; x++) {
+			uint32_t area = rows * (sc->x1 [x] - sc->x0 [x]);
+
+			dst [y * OLED_WIDTH + x] = (sum [x] + area / 2) / area;
+		}
+	}
+}
+
+/*
+** Floyd-Steinberg error diffusion, serpentine scan. The result is written
+** back as 0 / 255 so the threshold/pack step (threshold 127) packs it as is.
+*/
+static void floyd_steinberg (uint8_t *gray)
+{
+	int16_t err [2][OLED_WIDTH + 2];
+	int16_t *cur = err [0] + 1, *next = err [1] + 1;
+
+	memset(err, 0, sizeof(err));
+	for (int y = 0; y < OLED_HEIGHT; y++) {
+		uint8_t *line = gray + y * OLED_WIDTH;
+		int dir = (y & 1) ? -1 : 1;
+		int x = (y & 1) ? OLED_WIDTH - 1 : 0;
+
+		memset(next - 1, 0, sizeof(err [0]));
+		for (int n = 0; n < OLED_WIDTH; n++, x += dir) {
+			int v = line [x] + cur [x] / 16;
+			int out = v > 127 ? 255 : 0;
+			int e = v - out;
+
+			line [x] = out;
+			cur [x + dir]  += e * 7;
+			next [x - dir] += e * 3;
+			next [x]       += e * 5;
+			next [x + dir] += e * 1;
+		}
+		int16_t *tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+}
+
+/*
+** Threshold and pack in one pass: for every page and 16 column block, row k
+** of the page is compared against thresholds [k] and the resulting mask
+** contributes bit k of each column byte.
+*/
+static void threshold_pack (const uint8_t *gray, uint8_t *frame)
+{
+	for (int page = 0; page < OLED_PAGES; page++) {
+		const uint8_t *rows = gray + page * 8 * OLED_WIDTH;
+		uint8_t *out = frame + page * OLED_WIDTH;
+
+		for (int col = 0; col < OLED_WIDTH; col += 16) {
+#if defined(__SSE2__)
+			const __m128i bias = _mm_set1_epi8((char)0x80);
+			__m128i acc = _mm_setzero_si128();
+
+			for (int k = 0; k < 8; k++) {
+				/* no unsigned byte compare in SSE2, bias both sides */
+				__m128i g = _mm_loadu_si128((const __m128i *)(rows + k * OLED_WIDTH + col));
+				__m128i t = _mm_load_si128((const __m128i *)thresholds [k]);
+				__m128i m = _mm_cmpgt_epi8(_mm_xor_si128(g, bias), _mm_xor_si128(t, bias));
+
+				acc = _mm_or_si128(acc, _mm_and_si128(m, _mm_set1_epi8((char)(1 << k))));
+			}
+			_mm_storeu_si128((__m128i *)(out + col), acc);
+#elif defined(__ARM_NEON)
+			uint8x16_t acc = vdupq_n_u8(0);
+
+			for (int k = 0; k < 8; k++) {
+				uint8x16_t g = vld1q_u8(rows + k * OLED_WIDTH + col);
+				uint8x16_t m = vcgtq_u8(g, vld1q_u8(thresholds [k]));
+
+				acc = vorrq_u8(acc, vandq_u8(m, vdupq_n_u8(1 << k)));
+			}
+			vst1q_u8(out + col, acc);
+#else
+			for (int c = 0; c < 16; c++) {
+				uint8_t byte = 0;
+
+				for (int k = 0; k < 8; k++)
+					if (rows [k * OLED_WIDTH + col + c] > thresholds [k][c])
+						byte |= 1 << k;
+				out [col + c] = byte;
+			}
+#endif
+		}
+	}
+}
+
+static double now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void usage (void)
+{
+	printf ("Usage: oledimg [-d ordered|fs|none] [-o device|-] [file.pgm|file.ppm ...]\n");
+	printf ("  -d  dithering method (default: ordered)\n");
+	printf ("  -o  output device (default: %s), '-' writes packed frames to stdout\n", OLED_DEVICE);
+	printf ("  -q  do not print conversion statistics\n");
+	printf ("With no file (or '-') concatenated PNM frames are read from stdin.\n");
+}
+
+static int convert_stream (FILE *fp, int fd, int dither, struct image *img, struct scaler *sc,
+			   uint8_t *last, int *have_last, unsigned long *frames,
+			   unsigned long *skipped, double *busy_us)
+{
+	uint8_t gray [OLED_WIDTH * OLED_HEIGHT];
+	uint8_t frame [FRAME_SIZE];
+	int ret;
+
+	while ((ret = read_pnm (fp, img)) > 0) {
+		double start = now_us ();
+
+		if (img->width != sc->src_width || img->height != sc->src_height)
+			init_scaler (sc, img->width, img->height);
+		scale (sc, img->gray, gray);
+		if (dither == DITHER_FLOYD_STEINBERG)
+			floyd_steinberg (gray);
+		threshold_pack (gray, frame);
+		*busy_us += now_us () - start;
+		(*frames)++;
+
+		/* the bus is the slow part, never resend an identical frame */
+		if (*have_last && memcmp(frame, last, FRAME_SIZE) == 0) {
+			(*skipped)++;
+			continue;
+		}
+		if (fd == STDOUT_FILENO)
+			ret = write(fd, frame, FRAME_SIZE);
+		else
+			ret = pwrite(fd, frame, FRAME_SIZE, 0);
+		if (ret != FRAME_SIZE) {
+			perror("oledimg: write");
+			return -1;
+		}
+		memcpy(last, frame, FRAME_SIZE);
+		*have_last = 1;
+	}
+	return ret;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *device = OLED_DEVICE;
+	int dither = DITHER_ORDERED;
+	int quiet = 0;
+	int opt, fd, ret = 0;
+	struct image img = {0};
+	struct scaler sc = {0};
+	uint8_t last [FRAME_SIZE];
+	int have_last = 0;
+	unsigned long frames = 0, skipped = 0;
+	double busy_us = 0;
+
+	while ((opt = getopt(argc, argv, "d:o:qh")) != -1) {
+		switch (opt) {
+			case 'd':
+				if (strcmp(optarg, "ordered") == 0)
+					dither = DITHER_ORDERED;
+				else if (strcmp(optarg, "fs") == 0)
+					dither = DITHER_FLOYD_STEINBERG;
+				else if (strcmp(optarg, "none") == 0)
+					dither = DITHER_NONE;
+				else {
+					usage ();
+					return 1;
+				}
+				break;
+			case 'o':
+				device = optarg;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				usage ();
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (strcmp(device, "-") == 0)
+		fd = STDOUT_FILENO;
+	else if ((fd = open(device, O_WRONLY)) < 0) {
+		printf("Cannot open device file...\n");
+		return 1;
+	}
+
+	init_thresholds (dither);
+
+	if (optind == argc) {
+		ret = convert_stream (stdin, fd, dither, &img, &sc, last, &have_last,
+				      &frames, &skipped, &busy_us);
+	}
+	for (int i = optind; i < argc && ret >= 0; i++) {
+		FILE *fp = strcmp(argv [i], "-") ? fopen(argv [i], "rb") : stdin;
+
+		if (fp == NULL) {
+			perror(argv [i]);
+			ret = -1;
+			break;
+		}
+		ret = convert_stream (fp, fd, dither, &img, &sc, last, &have_last,
+				      &frames, &skipped, &busy_us);
+		if (fp != stdin)
+			fclose(fp);
+	}
+
+	if (!quiet && frames)
+		fprintf(stderr, "oledimg: %lu frames (%lu unchanged), %.1f us/frame conversion\n",
+			frames, skipped, busy_us / frames);
+
+	if (fd != STDOUT_FILENO)
+		close(fd);
+	free(img.gray);
+	free(img.row);
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "oledring.h"
+
+#define PANEL_COLUMNS 128
+#define PANEL_PAGES 8
+#define PANEL_ROWS (PANEL_PAGES * 8)
+
+int oled_ring_open (struct oled_ring *ring, const char *device)
+{
+	void *map;
+
+	ring->fd = open(device ? device : "/dev/oled_device", O_RDWR);
+	if (ring->fd < 0)
+		return -errno;
+
+	map = mmap(NULL, OLED_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (map == MAP_FAILED) {
+		int err = -errno;
+
+		close(ring->fd);
+		return err;
+	}
+	ring->hdr = map;
+	ring->cmds = (struct oled_ring_cmd *)((char *)map + OLED_RING_HDR_SIZE);
+
+	if (ring->hdr->magic != OLED_RING_MAGIC || ring->hdr->version != OLED_RING_VERSION ||
+	    ring->hdr->entries != OLED_RING_ENTRIES ||
+	    ring->hdr->entry_size != sizeof(struct oled_ring_cmd)) {
+		oled_ring_close (ring);
+		return -EPROTO;
+	}
+
+	/* pick up where a previous producer stopped */
+	ring->head = __atomic_load_n(&ring->hdr->head, __ATOMIC_RELAXED);
+	ring->tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+void oled_ring_close (struct oled_ring *ring)
+{
+	munmap(ring->hdr, OLED_RING_MAP_SIZE);
+	close(ring->fd);
+}
+
+/* next free record, cleared, NULL when the consumer has not freed one yet */
+static struct oled_ring_cmd *reserve (struct oled_ring *ring)
+{
+	struct oled_ring_cmd *cmd;
+
+	if (ring->head - ring->tail == OLED_RING_ENTRIES) {
+		ring->tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+		if (ring->head - ring->tail == OLED_RING_ENTRIES)
+			return NULL;
+	}
+	cmd = &ring->cmds [ring->head & (OLED_RING_ENTRIES - 1)];
+	memset(cmd, 0, sizeof(*cmd));
+	return cmd;
+}
+
+int oled_ring_text (struct oled_ring *ring, unsigned int column, unsigned int page, const char *text)
+{
+	struct oled_ring_cmd *cmd;
+	size_t len = strlen(text);
+
+	if (column >= PANEL_COLUMNS || page >= PANEL_PAGES)
+		return -EINVAL;
+	cmd = reserve (ring);
+	if (cmd == NULL)
+		return -EAGAIN;
+	if (len > OLED_RING_TEXT_MAX)
+		len = OLED_RING_TEXT_MAX;
+
+	cmd->op = OLED_RING_TEXT;
+	cmd->x = column;
+	cmd->y = page;
+	cmd->len = len;
+	memcpy(cmd->text, text, len);
+	ring->head++;
+	return 0;
+}
+
+int oled_ring_rect (struct oled_ring *ring, unsigned int x, unsigned int y,
+		    unsigned int w, unsigned int h, unsigned int value)
+{
+	struct oled_ring_cmd *cmd;
+
+	if (x >= PANEL_COLUMNS || y >= PANEL_ROWS || value > OLED_RECT_INVERT)
+		return -EINVAL;
+	cmd = reserve (ring);
+	if (cmd == NULL)
+		return -EAGAIN;
+
+	cmd->op = OLED_RING_RECT;
+	cmd->x = x;
+	cmd->y = y;
+	cmd->w = w > 255 ? 255 : w;
+	cmd->h = h > 255 ? 255 : h;
+	cmd->value = value;
+	ring->head++;
+	return 0;
+}
+
+int oled_ring_commit (struct oled_ring *ring)
+{
+	struct oled_ring_cmd *cmd = reserve (ring);
+
+	/*
+	** No room for the commit record: still publish what is there so the
+	** consumer can make progress, the caller retries the commit.
+	*/
+	if (cmd != NULL) {
+		cmd->op = OLED_RING_COMMIT;
+		ring->head++;
+	}
+
+	__atomic_store_n(&ring->hdr->head, ring->head, __ATOMIC_RELEASE);
+	/* pairs with the barrier between need_wakeup and the head re-check in the driver */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->hdr->need_wakeup, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->hdr->need_wakeup, 0, __ATOMIC_RELAXED);
+		if (ioctl(ring->fd, OLED_RING_DOORBELL) < 0)
+			return -errno;
+	}
+	return cmd != NULL ? 0 : -EAGAIN;
+}
+
+unsigned int oled_ring_pending (struct oled_ring *ring)
+{
+	return ring->head - __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+}
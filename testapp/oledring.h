@@ -0,0 +1,41 @@
+#ifndef __OLEDRING_H__
+#define __OLEDRING_H__
+
+/*
+** oledring - userspace producer side of the /dev/oled_device command ring.
+**
+** Draw calls only fill ring records; oled_ring_commit() publishes them with
+** a single store and rings the doorbell only when the flush worker has gone
+** idle, so a busy producer issues no system calls at all.
+**
+** One producer per ring: calls on the same struct oled_ring must not run
+** concurrently.
+*/
+#include <stdint.h>
+#include "../oled_ring.h"
+
+struct oled_ring {
+	int fd;
+	struct oled_ring_hdr *hdr;
+	struct oled_ring_cmd *cmds;
+	uint32_t head;		// next free slot, published on commit
+	uint32_t tail;		// cached consumer index
+};
+
+int oled_ring_open (struct oled_ring *ring, const char *device);
+void oled_ring_close (struct oled_ring *ring);
+
+/*
+** return 0, -EINVAL when the position is outside the panel (column < 128,
+** page < 8, x < 128, y < 64) or -EAGAIN when the ring is full (commit and
+** retry later)
+*/
+int oled_ring_text (struct oled_ring *ring, unsigned int column, unsigned int page, const char *text);
+int oled_ring_rect (struct oled_ring *ring, unsigned int x, unsigned int y,
+		    unsigned int w, unsigned int h, unsigned int value);
+int oled_ring_commit (struct oled_ring *ring);
+
+/* records published but not executed yet */
+unsigned int oled_ring_pending (struct oled_ring *ring);
+
+#endif
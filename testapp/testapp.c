@@ -11,6 +11,13 @@
 #define ZOOM_IN _IOW('a', 'b', int*)
 #define BLINKING _IOW('a', 'c', int*)
 #define SCROLLING _IOW('a', 'd', int*)
+#define SET_SCHED _IOW('a', 'g', struct oled_sched_param*)
+
+/* update classes, a lower value wins the panel first */
+struct oled_sched_param {
+	int update_class;		// 0 alert, 1 interactive, 2 stream, 3 bulk
+	unsigned int deadline_us;	// 0 = default of the class
+};
 
 #define MAX_LIMIT 100
 enum {
@@ -19,7 +26,8 @@ enum {
 	ZOOM,
 	BLINK,
 	SCROLL,
-	MENU
+	MENU,
+	PRIORITY
 };
 
 void print_menu (void)
@@ -30,7 +38,7 @@ void print_menu (void)
  supports graphic modes like scrolling, blinking and\nzooming in.\n");
         printf ("*****************************************************************************************************************************\n");
         printf ("User can configure the OLED module by:\n0. Exit.\n1. Display string.\n2.\
- Enable/Disable zoom in.\n3. Enable/Disable text blinking.\n4. Enable scrolling.\n5. Print menu.\n");
+ Enable/Disable zoom in.\n3. Enable/Disable text blinking.\n4. Enable scrolling.\n5. Print menu.\n6. Set update priority.\n");
         printf ("*****************************************************************************************************************************\n");
         printf ("*****************************************************************************************************************************\n");
 }
@@ -40,6 +48,7 @@ int main()
 	int fd;
 	char str [MAX_LIMIT] = {'\0'};
 	int on_off_value = 0;
+	struct oled_sched_param sched = {0};
 	//printf("Opening Driver...\n");
 
 	fd = open("/dev/oled_device", O_RDWR);
@@ -84,6 +93,12 @@ int main()
 			case MENU:
 				print_menu ();
 				break;
+			case PRIORITY:
+				printf("Enter the class (0 alert, 1 interactive, 2 stream, 3 bulk) and deadline in us (0 = default):\n");
+				scanf ("%d %u", &sched.update_class, &sched.deadline_us);
+				if (ioctl(fd, SET_SCHED, &sched) < 0)
+					printf ("Invalid class!!!\n");
+				break;
 			default:
 				printf ("Enter a valid choice!!!\n");
 				break;